@@ -1,6 +1,25 @@
+#include <charconv>
 #include <parser.hh>
+#include <server.hh>
+
+int main(int argc, char** argv) {
+    // Run as a server if asked to.
+    if (argc >= 2 and std::string_view{argv[1]} == "--serve") {
+        static constexpr std::string_view usage = "Usage: {} --serve <socket path> [<number of workers>]";
+        if (argc < 3 or argc > 4) die(usage, argv[0]);
+
+        usz workers = std::thread::hardware_concurrency();
+        if (argc == 4) {
+            std::string_view arg = argv[3];
+            auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), workers);
+            if (ec != std::errc{} or end != arg.data() + arg.size() or workers == 0)
+                die(usage, argv[0]);
+        }
+
+        Server{argv[2], workers}.Run();
+        return 0;
+    }
 
-int main() {
     std::string input;
     for (;;) {
         fmt::print("> ");
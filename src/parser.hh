@@ -1,20 +1,33 @@
 #ifndef PARSER_HH
 #define PARSER_HH
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <memory_resource>
+#include <optional>
 #include <string>
 #include <utils.hh>
+#include <variant>
 #include <vector>
 
 // Simple inline markdown parser, intended to be translated to Java
 // in the future so it can be integrated into Minecraft. That also
 // explains the use of e.g. std::list.
-struct Parser {
+//
+// The parser works directly on UTF-8 or UTF-16 input, and its output
+// uses the same encoding as the input; see BasicParser below. Everything
+// in here doesn’t depend on the encoding.
+struct ParserBase {
     struct Span;
     struct Emph;
     using Node = std::variant<Emph, Span>;
-    using NodeRef = std::list<Node>::iterator;
+    using NodeList = std::pmr::list<Node>;
+    using NodeRef = NodeList::iterator;
 
     struct Emph {
         enum struct Kind {
@@ -25,8 +38,12 @@ struct Parser {
             Spoiler,
         };
 
-        std::list<Node> nodes;
+        NodeList nodes;
         Kind kind;
+
+        // Nesting depth of this node, counting itself; an Emph that
+        // contains no other Emph has depth 1.
+        u32 depth;
     };
 
     struct Span {
@@ -41,6 +58,62 @@ struct Parser {
         u32 size() const { return end - start; }
     };
 
+    // Upper bounds on the work a single input can cause. When a limit is
+    // hit, the rest of the input is treated as literal text (or, for the
+    // output limit, omitted) and the corresponding flag in `status` is set;
+    // parsing is never aborted.
+    //
+    // The node that holds the remaining input is always created, so the
+    // node limit is effectively at least 1.
+    struct Limits {
+        u32 max_nesting_depth = 128;
+        u32 max_delimiters = std::numeric_limits<u32>::max();
+        u32 max_nodes = std::numeric_limits<u32>::max();
+        usz max_output_bytes = std::numeric_limits<usz>::max();
+    };
+
+    // What to do with input that isn’t valid UTF-8 (or UTF-16, i.e. contains
+    // lone surrogates): either replace every maximal invalid subsequence with
+    // U+FFFD in the output, or reject the input, i.e. produce no output.
+    enum struct OnInvalidEncoding {
+        Replace,
+        Reject,
+    };
+
+    // Which limits, if any, were hit, and whether the input was invalid.
+    struct Status {
+        bool nesting_depth_exceeded : 1 = false;
+        bool delimiters_exceeded    : 1 = false;
+        bool nodes_exceeded         : 1 = false;
+        bool output_bytes_exceeded  : 1 = false;
+        bool invalid_encoding       : 1 = false;
+
+        bool limit_exceeded() const {
+            return nesting_depth_exceeded or
+                   delimiters_exceeded or
+                   nodes_exceeded or
+                   output_bytes_exceeded;
+        }
+
+        bool ok() const { return not limit_exceeded() and not invalid_encoding; }
+    };
+
+    static constexpr i32 BottomOfStack = -1;
+
+    // Classify a character. Only ASCII characters count as whitespace or
+    // punctuation; everything else is treated like a letter.
+    static bool IsWhitespace(char32_t c) { return c < 0x80 and std::isspace(int(c)); }
+    static bool IsPunctuation(char32_t c) { return c < 0x80 and std::ispunct(int(c)); }
+};
+
+// CharType is the code unit type of the input: `char` for UTF-8, and
+// `char16_t` for UTF-16.
+template <typename CharType>
+struct BasicParser : ParserBase {
+    using Char = CharType;
+    using String = std::basic_string<Char>;
+    using StringView = std::basic_string_view<Char>;
+
     struct Delimiter {
         NodeRef node;
         bool can_open          : 1 = false;
@@ -50,32 +123,92 @@ struct Parser {
         bool preceded_by_punct : 1 = false;
         bool followed_by_punct : 1 = false;
 
+        // Position in the stack, counting from the bottom; only
+        // used by ProcessEmphasis().
+        u32 index{};
+
         bool clopen() { return can_open and can_close; }
         u32 count() { return std::get<Span>(*node).size(); }
-        char kind(Parser* p) { return p->input[std::get<Span>(*node).start]; }
+        Char kind(BasicParser* p) { return p->input[std::get<Span>(*node).start]; }
         void remove(u32 count) { std::get<Span>(*node).start += count; }
     };
 
-    static constexpr i32 BottomOfStack = -1;
+    // A run of text with a single style, for renderers that don’t use markup;
+    // see PrintStyleRuns().
+    struct StyleRun {
+        enum : u8 {
+            Bold          = 1 << 0,
+            Italic        = 1 << 1,
+            Underline     = 1 << 2,
+            Strikethrough = 1 << 3,
+            Spoiler       = 1 << 4,
+            Code          = 1 << 5,
+        };
 
-    std::string_view input;
-    std::list<Node> nodes;
-    std::list<Delimiter> delimiter_stack;
+        StringView text;
+        u8 style{};
+    };
 
-    Parser(std::string_view text);
+    // Sizes of the buffers that nodes, delimiters and the output of PrintInline()
+    // are allocated in. They fit typical chat messages, which can then be parsed
+    // and printed without any heap allocations; larger inputs transparently fall
+    // back to the heap.
+    static constexpr usz InlineStorageSize = 4096;
+    static constexpr usz InlineOutputSize = 512;
+
+    StringView input;
+    alignas(std::max_align_t) std::array<std::byte, InlineStorageSize> inline_storage;
+    alignas(std::max_align_t) std::array<std::byte, InlineOutputSize> inline_output_storage;
+    std::pmr::monotonic_buffer_resource arena{inline_storage.data(), inline_storage.size()};
+    std::pmr::monotonic_buffer_resource output_arena{inline_output_storage.data(), inline_output_storage.size()};
+    NodeList nodes{&arena};
+    std::pmr::list<Delimiter> delimiter_stack{&arena};
+    std::pmr::basic_string<Char> output{&output_arena};
+    std::pmr::vector<Span> invalid{&arena};
+    Limits limits;
+    OnInvalidEncoding on_invalid_encoding;
+    Status status;
+
+    BasicParser(
+        StringView text,
+        Limits limits = {},
+        OnInvalidEncoding on_invalid_encoding = OnInvalidEncoding::Replace
+    );
+
+    // Nodes and delimiters refer to each other and to the arena.
+    BasicParser(const BasicParser&) = delete;
+    BasicParser& operator=(const BasicParser&) = delete;
+
+    bool CanAddNodes(usz count);
     bool ClassifyDelimiter(u32 start_of_text, Span text);
+    auto CodePointAt(usz pos) -> char32_t;
+    auto CodePointBefore(usz pos) -> char32_t;
     void DumpNodes();
-    bool IsUnicodeWhitespace(char c);
+    static bool IsEscapable(Char c);
+    static auto NormaliseCodeSpan(StringView text) -> StringView;
     void Parse();
     void ProcessEmphasis();
-    auto Print() -> std::string;
+    auto Print() -> String;
+    auto PrintInline() -> StringView;
+    void PrintStyleRuns(std::vector<StyleRun>& runs, String& buffer);
+    template <typename Out>
+    void PrintTo(Out& out);
+    bool RejectIfInvalid();
+    static constexpr auto Replacement() -> StringView;
+    template <typename Callback>
+    void ReplaceInvalid(StringView text, Callback emit);
+    auto Scan(usz pos, usz end, bool stop_at_delimiter) -> usz;
+    auto ValidateSequence(usz pos, usz end) -> usz;
 };
 
+using Parser = BasicParser<char>;
+using Parser16 = BasicParser<char16_t>;
+
 template <>
-struct fmt::formatter<Parser::Emph::Kind> : formatter<std::string_view> {
+struct fmt::formatter<ParserBase::Emph::Kind> : formatter<std::string_view> {
     template <typename FormatContext>
-    auto format(Parser::Emph::Kind k, FormatContext& ctx) {
-        using enum Parser::Emph::Kind;
+    auto format(ParserBase::Emph::Kind k, FormatContext& ctx) {
+        using enum ParserBase::Emph::Kind;
         std::string_view sv = k == Italic        ? "em"
                             : k == Bold          ? "strong"
                             : k == Underline     ? "uline"
@@ -85,15 +218,28 @@ struct fmt::formatter<Parser::Emph::Kind> : formatter<std::string_view> {
     }
 };
 
-inline Parser::Parser(std::string_view text) {
+template <typename CharType>
+BasicParser<CharType>::BasicParser(
+    StringView text,
+    Limits limits,
+    OnInvalidEncoding on_invalid_encoding
+) : limits{limits}, on_invalid_encoding{on_invalid_encoding} {
     input = text;
     delimiter_stack.emplace_back(); // Bottom of stack.
     Parse();
-    DumpNodes();
     ProcessEmphasis();
 }
 
-inline bool Parser::ClassifyDelimiter(u32 start_of_text, Span text) {
+template <typename CharType>
+bool BasicParser<CharType>::CanAddNodes(usz count) {
+    // Always leave room for the node that holds the remaining input.
+    if (nodes.size() + count + 1 <= limits.max_nodes) return true;
+    status.nodes_exceeded = true;
+    return false;
+}
+
+template <typename CharType>
+bool BasicParser<CharType>::ClassifyDelimiter(u32 start_of_text, Span text) {
     // 6.2 Emphasis and strong emphasis
     //
     // A left-flanking delimiter run is a delimiter run that is
@@ -126,23 +272,23 @@ inline bool Parser::ClassifyDelimiter(u32 start_of_text, Span text) {
     // with ‘previous’ and vice versa. The algorithm implemented here is the one
     // for left-flanking delimiters. It can be used to compute the right-flanking
     // property by swapping the ‘next’ and ‘prev’ parameters.
-    const auto IsFlankingDelimiter = [&](char prev, char next) {
-        if (next == 0) return false;             // 1.
-        if (std::isspace(next)) return false;    // 2.
-        if (not std::ispunct(next)) return true; // 3.
-        if (prev == 0) return true;              // 4.
-        if (std::isspace(prev)) return true;     // 5.
-        if (std::ispunct(prev)) return true;     // 6.
-        return false;                            // 7.
+    const auto IsFlankingDelimiter = [&](char32_t prev, char32_t next) {
+        if (next == 0) return false;              // 1.
+        if (IsWhitespace(next)) return false;     // 2.
+        if (not IsPunctuation(next)) return true; // 3.
+        if (prev == 0) return true;               // 4.
+        if (IsWhitespace(prev)) return true;      // 5.
+        if (IsPunctuation(prev)) return true;     // 6.
+        return false;                             // 7.
     };
 
-    const char next = text.end < input.size() ? input[text.end] : 0;
-    const char prev = text.start > 0 ? input[text.start - 1] : 0;
-    const char kind = input[text.start];
+    const char32_t next = CodePointAt(text.end);
+    const char32_t prev = CodePointBefore(text.start);
+    const Char kind = input[text.start];
     bool left_flanking = IsFlankingDelimiter(prev, next);
     bool right_flanking = IsFlankingDelimiter(next, prev);
-    bool preceded_by_punct = prev != 0 and std::ispunct(prev);
-    bool followed_by_punct = next != 0 and std::ispunct(next);
+    bool preceded_by_punct = prev != 0 and IsPunctuation(prev);
+    bool followed_by_punct = next != 0 and IsPunctuation(next);
 
     // Ibid.
     //
@@ -179,6 +325,17 @@ inline bool Parser::ClassifyDelimiter(u32 start_of_text, Span text) {
     // it’s just text.
     if (not can_open and not can_close) return false;
 
+    // Make sure we're allowed to create the delimiter and its nodes; if not,
+    // the caller stops here and treats the rest of the input as text. Note
+    // that the delimiter stack also contains the bottom of the stack.
+    if (delimiter_stack.size() > limits.max_delimiters) {
+        status.delimiters_exceeded = true;
+        return false;
+    }
+
+    if (not CanAddNodes(start_of_text != text.start ? 2 : 1))
+        return false;
+
     // We have a delimiter; append the text we've read so far.
     if (start_of_text != text.start) nodes.emplace_back(Span{start_of_text, text.start});
 
@@ -200,12 +357,51 @@ inline bool Parser::ClassifyDelimiter(u32 start_of_text, Span text) {
     return true;
 }
 
-inline void Parser::DumpNodes() {
+template <typename CharType>
+auto BasicParser<CharType>::CodePointAt(usz pos) -> char32_t {
+    if (pos >= input.size()) return 0;
+
+    // Only ASCII characters are ever classified as anything, so for UTF-8, looking
+    // at a single byte is enough. For UTF-16, a surrogate pair is one character; a
+    // lone surrogate is treated as U+FFFD.
+    if constexpr (sizeof(Char) == 1) {
+        return char32_t(u8(input[pos]));
+    } else {
+        char32_t c = input[pos];
+        if (c < 0xD800 or c > 0xDFFF) return c;
+        if (c <= 0xDBFF and pos + 1 < input.size() and input[pos + 1] >= 0xDC00 and input[pos + 1] <= 0xDFFF)
+            return 0x10000 + ((c - 0xD800) << 10) + (char32_t(input[pos + 1]) - 0xDC00);
+        return 0xFFFD;
+    }
+}
+
+template <typename CharType>
+auto BasicParser<CharType>::CodePointBefore(usz pos) -> char32_t {
+    if (pos == 0) return 0;
+    if constexpr (sizeof(Char) == 1) {
+        return char32_t(u8(input[pos - 1]));
+    } else {
+        char32_t c = input[pos - 1];
+        if (c >= 0xDC00 and c <= 0xDFFF and pos >= 2 and input[pos - 2] >= 0xD800 and input[pos - 2] <= 0xDBFF)
+            return CodePointAt(pos - 2);
+        return CodePointAt(pos - 1);
+    }
+}
+
+template <typename CharType>
+void BasicParser<CharType>::DumpNodes() {
     struct Printer {
-        Parser* p;
+        BasicParser* p;
         usz indent = 0;
         void operator()(Span sp) {
-            fmt::print("{}Span: '{}'\n", std::string(indent, ' '), p->input.substr(sp.start, sp.size()));
+            // Only print ASCII characters as-is; fmt can’t print UTF-16 text.
+            std::string text;
+            for (auto c : p->input.substr(sp.start, sp.size())) {
+                if (sizeof(Char) == 1 or c < 0x80) text += char(c);
+                else text += fmt::format("\\u{:04X}", u32(c));
+            }
+
+            fmt::print("{}Span: '{}'\n", std::string(indent, ' '), text);
         }
 
         void operator()(Emph& e) {
@@ -220,9 +416,48 @@ inline void Parser::DumpNodes() {
     for (auto& n : nodes) std::visit(p, n);
 }
 
-inline void Parser::Parse() {
+template <typename CharType>
+bool BasicParser<CharType>::IsEscapable(Char c) {
+    static constexpr std::string_view escapable = "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+    return c > 0 and c < 0x80 and escapable.find(char(c)) != std::string_view::npos;
+}
+
+template <typename CharType>
+auto BasicParser<CharType>::NormaliseCodeSpan(StringView text) -> StringView {
+    // Line endings are converted to spaces; that is left to the caller.
+    //
+    // If the resulting string both begins and ends with a space character,
+    // but does not consist entirely of space characters, a single space
+    // character is removed from the front and back. This allows you to include
+    // code that begins or ends with backtick characters, which must be separated
+    // by whitespace from the opening or closing backtick strings.
+    static constexpr Char spaces[] = {' ', '\n'};
+    const auto IsSpace = [](Char c) { return c == ' ' or c == '\n'; };
+    if (
+        text.size() > 2 and
+        IsSpace(text.front()) and
+        IsSpace(text.back()) and
+        text.find_first_not_of(spaces, 0, std::size(spaces)) != StringView::npos
+    ) return text.substr(1, text.size() - 2);
+    return text;
+}
+
+template <typename CharType>
+void BasicParser<CharType>::Parse() {
     usz pos = 0;
     usz start_of_text = pos;
+
+    // Everything before this has been validated. Validation is done by the same
+    // scan that looks for delimiters; the only characters it skips are those of
+    // delimiters and code spans.
+    usz validated = 0;
+
+    // Start of the last backtick string of each length. This is only filled in
+    // once we fail to find a closing backtick string, after which we can tell
+    // whether there is one without searching the rest of the input again; this
+    // keeps e.g. ‘` `` ``` ...’ from taking quadratic time.
+    std::pmr::vector<u32> last_backtick_string{&arena};
+    bool backticks_scanned = false;
     while (pos < input.size()) {
         // 6.1 Code spans
         //
@@ -240,12 +475,15 @@ inline void Parser::Parse() {
         //        followed by a non-backslash-escaped `_` character.
         //
         // EXTENSION: `~~`/`||` are also a delimiters.
-        usz start = input.find_first_of("*_~|`", pos);
-        if (start == std::string::npos) {
+        usz start = Scan(pos, input.size(), true);
+        if (RejectIfInvalid()) return;
+        if (start == StringView::npos) {
             nodes.emplace_back(Span{start_of_text, input.size()});
             return;
         }
 
+        validated = start;
+
         // Check if this is escaped; to do that, read backslashes before the character;
         // note that backslashes can escape each other, so only treat this as escaped
         // if we find an odd number of backslashes.
@@ -267,15 +505,37 @@ inline void Parser::Parse() {
         // that backslash-escapes are not allowed in code spans, so we don’t even
         // have to worry about that).
         if (input[start] == '`') {
+            // If there is no closing backtick string, then these backticks are
+            // literal; only skip past them.
+            if (
+                backticks_scanned and
+                (count >= last_backtick_string.size() or last_backtick_string[count] <= start)
+            ) {
+                pos = start + count;
+                continue;
+            }
+
             auto search_start = start + count;
             for (;;) {
                 auto end = input.find({input.data() + start, count}, search_start);
 
                 // If we don’t find a matching backtick string, then these backticks are
                 // literal; stop searching.
-                if (end == std::string::npos) {
+                if (end == StringView::npos) {
                     // Only skip past the initial backticks.
                     pos = start + count;
+
+                    // Record the backtick strings in the rest of the input.
+                    if (not backticks_scanned) {
+                        backticks_scanned = true;
+                        for (usz i = input.find('`', pos); i != StringView::npos; i = input.find('`', i)) {
+                            usz n = 1;
+                            while (i + n < input.size() and input[i + n] == '`') n++;
+                            if (n >= last_backtick_string.size()) last_backtick_string.resize(n + 1);
+                            last_backtick_string[n] = u32(i);
+                            i += n;
+                        }
+                    }
                     break;
                 }
 
@@ -294,15 +554,19 @@ inline void Parser::Parse() {
                 }
 
                 // Otherwise, we’ve found the end of a code span.
+                if (not CanAddNodes(2)) break;
+                Scan(start + count, end, false);
+                if (RejectIfInvalid()) return;
                 nodes.emplace_back(Span{start_of_text, start});
                 nodes.emplace_back(Span{start + count, end, true});
-                pos = start_of_text = end + count;
+                pos = start_of_text = validated = end + count;
                 break;
             }
 
             // We handled the code span, either by skipping it and treating it as literal
             // or by inserting a code span node. In either case, there is no more delimiter
             // processing to be done here.
+            if (status.limit_exceeded()) break;
             continue;
         }
 
@@ -316,16 +580,22 @@ inline void Parser::Parse() {
         if (ClassifyDelimiter(start_of_text, Span{start, start + count}))
             start_of_text = start + count;
 
+        // If we’ve hit a limit, the rest of the input is literal text.
+        if (status.limit_exceeded()) break;
+
         // Move past it.
         pos = start + count;
     }
 
-    // Append remaining text.
+    // Validate and append remaining text.
+    Scan(validated, input.size(), false);
+    if (RejectIfInvalid()) return;
     if (start_of_text < input.size())
         nodes.emplace_back(Span{start_of_text, input.size()});
 }
 
-inline void Parser::ProcessEmphasis() {
+template <typename CharType>
+void BasicParser<CharType>::ProcessEmphasis() {
     // Note: we always have an empty delimiter at the bottom of the stack.
     if (delimiter_stack.size() == 1)
         return;
@@ -334,35 +604,120 @@ inline void Parser::ProcessEmphasis() {
     // just above stack_bottom (or the first element if stack_bottom is NULL).
     auto current_position = std::next(delimiter_stack.begin());
 
+    // Total number of nodes; before we start, they’re all at the top level.
+    usz node_count = nodes.size();
+
     // We keep track of the openers_bottom for each delimiter type (*, _),
     // indexed to the length of the closing delimiter run (modulo 3) and to
     // whether the closing delimiter can also be an opener. Initialize this
     // to stack_bottom.
+    //
+    // Every delimiter below current_position is a potential opener. Rather than
+    // walking over all of them to find a match, we also keep them in chains, one
+    // for each delimiter type, length modulo 3, and whether the delimiter can also
+    // be a closer. Those are the only properties of an opener that determine whether
+    // it matches a closer, so the first matching opener is always at the top of one
+    // of those chains, and looking for it takes constant time.
     class Openers {
-        using Iterator = std::list<Delimiter>::iterator;
-        Parser& p;
-        std::array<Iterator, 3> star;
-        std::array<Iterator, 3> underscore;
-        std::array<Iterator, 3> tilde;
-        std::array<Iterator, 3> pipe;
-
-    public:
-        Openers(Parser& p) : p{p} {
-            star.fill(p.delimiter_stack.begin());
-            underscore.fill(p.delimiter_stack.begin());
-            tilde.fill(p.delimiter_stack.begin());
-            pipe.fill(p.delimiter_stack.begin());
+        using Iterator = std::pmr::list<Delimiter>::iterator;
+        BasicParser& p;
+
+        // Bottoms and chains refer to delimiters by their index in the stack; the
+        // bottom of the stack has index 0, which also means ‘no delimiter’.
+        std::array<std::array<u32, 3>, 4> bottoms{};
+        std::array<std::array<std::array<u32, 2>, 3>, 4> chains{};
+        std::pmr::vector<Iterator> delimiters;
+        std::pmr::vector<u32> next_in_chain;
+
+        auto Chain(Delimiter& d) -> u32& {
+            return chains[Kind(d)][d.count() % 3][d.clopen()];
         }
 
-        auto operator[](Delimiter& d) -> Iterator& {
+        auto Kind(Delimiter& d) -> usz {
             switch (d.kind(&p)) {
-                case '*': return star[d.count() % 3];
-                case '_': return underscore[d.count() % 3];
-                case '~': return tilde[d.count() % 3];
-                case '|': return pipe[d.count() % 3];
+                case '*': return 0;
+                case '_': return 1;
+                case '~': return 2;
+                case '|': return 3;
                 default: die("unreachable");
             }
         }
+
+        // 6.2 Emphasis and strong emphasis Rule 9/10
+        //
+        // If one of the delimiters can both open and close emphasis, then the sum of the
+        // lengths of the delimiter runs containing the opening and closing delimiters must
+        // not be a multiple of 3 unless both lengths are multiples of 3.
+        static bool Matches(u32 opener_count_mod_3, bool opener_clopen, Delimiter& closer) {
+            if (not opener_clopen and not closer.clopen()) return true;
+            auto l2 = closer.count();
+            if (opener_count_mod_3 == 0 and l2 % 3 == 0) return true;
+            return (opener_count_mod_3 + l2) % 3 != 0;
+        }
+
+    public:
+        Openers(BasicParser& p) : p{p}, delimiters{&p.arena}, next_in_chain{&p.arena} {
+            delimiters.reserve(p.delimiter_stack.size());
+            u32 index = 0;
+            for (auto it = p.delimiter_stack.begin(); it != p.delimiter_stack.end(); ++it) {
+                it->index = index++;
+                delimiters.push_back(it);
+            }
+
+            next_in_chain.resize(delimiters.size());
+        }
+
+        // Look for the first opener that matches a closer.
+        auto Find(Delimiter& closer) -> std::optional<Iterator> {
+            auto kind = Kind(closer);
+            u32 bottom = bottoms[kind][closer.count() % 3];
+            u32 found = 0;
+            for (u32 mod = 0; mod < 3; mod++) {
+                for (bool clopen : {false, true}) {
+                    u32 top = chains[kind][mod][clopen];
+                    if (top > bottom and top > found and Matches(mod, clopen, closer))
+                        found = top;
+                }
+            }
+
+            if (found == 0) return std::nullopt;
+            return delimiters[found];
+        }
+
+        // Add a delimiter that current_position has moved past. It is above every
+        // delimiter that is already in a chain.
+        void Push(Delimiter& d) {
+            auto& top = Chain(d);
+            next_in_chain[d.index] = top;
+            top = d.index;
+        }
+
+        // Remove the top delimiter of its chain; this must be called before
+        // its count changes.
+        void Pop(Delimiter& d) {
+            auto& top = Chain(d);
+            top = next_in_chain[top];
+        }
+
+        // Forget about all delimiters above the one with this index because they
+        // have been removed from the stack.
+        void RemoveAbove(u32 index) {
+            for (auto& kind : chains)
+                for (auto& mod : kind)
+                    for (auto& top : mod)
+                        while (top > index)
+                            top = next_in_chain[top];
+
+            // An openers_bottom that has been removed no longer bounds the search.
+            for (auto& kind : bottoms)
+                for (auto& bottom : kind)
+                    if (bottom > index)
+                        bottom = 0;
+        }
+
+        void SetBottom(Delimiter& closer, Delimiter& bottom) {
+            bottoms[Kind(closer)][closer.count() % 3] = bottom.index;
+        }
     } openers{*this};
 
     // Then we repeat the following until we run out of potential closers:
@@ -375,7 +730,7 @@ inline void Parser::ProcessEmphasis() {
         // Note: can_close_strong implies can_close, so we only need to check
         // for the latter.
         while (current_position != delimiter_stack.end() and !current_position->can_close)
-            ++current_position;
+            openers.Push(*current_position++);
 
         // Out of closers.
         if (current_position == delimiter_stack.end())
@@ -384,29 +739,12 @@ inline void Parser::ProcessEmphasis() {
         // Now, look back in the stack (staying above stack_bottom and the openers_bottom
         // for this delimiter type) for the first matching potential opener (“matching” means
         // same delimiter—that is, same kind *and same count*).
-        auto opener = std::prev(current_position);
-        bool found = false;
-        while (opener != delimiter_stack.begin() and opener != openers[*current_position]) {
-            // 6.2 Emphasis and strong emphasis Rule 9/10
-            //
-            // If one of the delimiters can both open and close emphasis, then the sum of the
-            // lengths of the delimiter runs containing the opening and closing delimiters must
-            // not be a multiple of 3 unless both lengths are multiples of 3.
-            found = [&] {
-                if (opener->kind(this) != current_position->kind(this)) return false;
-                if (not opener->clopen() and not current_position->clopen()) return true;
-                auto l1 = opener->count();
-                auto l2 = current_position->count();
-                if (l1 % 3 == 0 and l2 % 3 == 0) return true;
-                return (l1 + l2) % 3 != 0;
-            }();
-
-            if (found) break;
-            --opener;
-        }
+        auto found = openers.Find(*current_position);
 
         // If one is found:
         if (found) {
+            auto opener = *found;
+
             // Figure out whether we have emphasis or strong emphasis: if both closer and
             // opener spans have length >= 2, we have strong, otherwise regular.
             //
@@ -422,17 +760,44 @@ inline void Parser::ProcessEmphasis() {
                 }
             }();
 
+            // Check the limits before creating the node. If we can’t create it, stop
+            // here; any delimiters that are left over are then printed as text.
+            //
+            // The nodes between the opener and closer are moved into the new node, so
+            // we only ever look at each node once here.
+            u32 depth = 1;
+            for (auto n = std::next(opener->node); n != current_position->node; ++n)
+                if (auto e = std::get_if<Emph>(&*n))
+                    depth = std::max(depth, e->depth + 1);
+
+            if (depth > limits.max_nesting_depth) {
+                status.nesting_depth_exceeded = true;
+                return;
+            }
+
+            u8 count = strong ? 2 : 1;
+            usz removed = usz(opener->count() == count) + usz(current_position->count() == count);
+            if (node_count + 1 - removed > limits.max_nodes) {
+                status.nodes_exceeded = true;
+                return;
+            }
+
+            node_count = node_count + 1 - removed;
+
             // Insert an emph or strong emph node accordingly, after the text node
             // corresponding to the opener and remove any delimiters between the
             // opener and closer from the delimiter stack.
-            auto emph_node = nodes.insert(std::next(opener->node), Emph{{}, kind});
+            auto emph_node = nodes.insert(std::next(opener->node), Emph{NodeList{&arena}, kind, depth});
             auto& emph = std::get<Emph>(*emph_node);
             emph.nodes.splice(emph.nodes.begin(), nodes, std::next(emph_node), current_position->node);
             delimiter_stack.erase(std::next(opener), current_position);
+            openers.RemoveAbove(opener->index);
 
             // Remove 1 (for regular emph) or 2 (for strong emph) delimiters from the
-            // opening and closing text nodes.
-            u8 count = strong ? 2 : 1;
+            // opening and closing text nodes. The opener is now the topmost delimiter
+            // below current_position, so it is the top of its chain; move it to the
+            // chain for its new length.
+            openers.Pop(*opener);
             opener->remove(count);
             current_position->remove(count);
 
@@ -440,7 +805,10 @@ inline void Parser::ProcessEmphasis() {
             // element of the delimiter stack.
             if (opener->count() == 0) {
                 nodes.erase(opener->node);
+                openers.RemoveAbove(opener->index - 1);
                 delimiter_stack.erase(opener);
+            } else {
+                openers.Push(*opener);
             }
 
             // If the closing node is removed, reset current_position to the next element
@@ -456,59 +824,237 @@ inline void Parser::ProcessEmphasis() {
             // Set openers_bottom to the element before current_position. (We know that
             // there are no openers for this kind of closer up to and including this point,
             // so this puts a lower bound on future searches.)
-            openers[*current_position] = std::prev(current_position);
+            openers.SetBottom(*current_position, *std::prev(current_position));
 
             // If the closer at current_position is not a potential opener, remove it from the
             // delimiter stack (since we know it can’t be a closer either). Advance current_position
             // to the next element in the stack.
             if (!current_position->can_open) current_position = delimiter_stack.erase(current_position);
-            else ++current_position;
+            else openers.Push(*current_position++);
         }
     }
 }
 
-inline auto Parser::Print() -> std::string {
+template <typename CharType>
+auto BasicParser<CharType>::Print() -> String {
+    String s;
+    PrintTo(s);
+    return s;
+}
+
+template <typename CharType>
+auto BasicParser<CharType>::PrintInline() -> StringView {
+    // Use up the entire inline buffer at once rather than growing into it.
+    output.reserve(InlineOutputSize / sizeof(Char) - 1);
+    PrintTo(output);
+    return output;
+}
+
+template <typename CharType>
+void BasicParser<CharType>::PrintStyleRuns(std::vector<StyleRun>& runs, String& buffer) {
+    // Every character we emit corresponds to a different character of the input,
+    // except for replacement characters, so the buffer never needs to grow beyond
+    // this, which keeps views into it valid while we’re still appending to it.
+    runs.clear();
+    buffer.clear();
+    buffer.reserve(input.size() + invalid.size() * (Replacement().size() - 1));
+
     struct Printer {
-        Parser* p;
-        std::string s{};
+        BasicParser* p;
+        std::vector<StyleRun>& runs;
+        String& buffer;
+        u8 style = 0;
+        bool last_in_buffer = false;
+
+        // Number of characters in all runs so far; see PrintTo().
+        usz emitted = 0;
+        bool truncated = false;
+
+        // Check whether we can emit this many more characters without going over
+        // the output limit; once we can’t, we stop emitting anything.
+        bool Fits(usz chars) {
+            if (truncated) return false;
+            if ((emitted + chars) * sizeof(Char) <= p->limits.max_output_bytes) return true;
+            truncated = true;
+            return false;
+        }
+
+        // Append text that is part of the input, replacing invalid code units.
+        void Append(StringView text) {
+            p->ReplaceInvalid(text, [&](StringView piece, bool replacement) {
+                if (not Fits(piece.size())) return;
+                emitted += piece.size();
+                if (replacement) AppendToBuffer(piece);
+                else AppendSource(piece);
+            });
+        }
+
+        // Append valid text that is part of the input.
+        void AppendSource(StringView text) {
+            if (text.empty()) return;
+            if (runs.empty() or runs.back().style != style) {
+                runs.emplace_back(text, style);
+                last_in_buffer = false;
+                return;
+            }
+
+            // If this directly follows the previous run in the input,
+            // we can just extend it.
+            auto& last = runs.back();
+            if (not last_in_buffer and last.text.data() + last.text.size() == text.data()) {
+                last.text = {last.text.data(), last.text.size() + text.size()};
+                return;
+            }
+
+            AppendToBuffer(text);
+        }
+
+        // Append text that has to be copied into the buffer.
+        void AppendToBuffer(StringView text) {
+            if (runs.empty() or runs.back().style != style) {
+                auto start = buffer.size();
+                buffer += text;
+                runs.emplace_back(StringView{buffer}.substr(start), style);
+                last_in_buffer = true;
+                return;
+            }
+
+            // Move the previous run into the buffer so we can extend it.
+            auto& last = runs.back();
+            if (not last_in_buffer) {
+                auto start = buffer.size();
+                buffer += last.text;
+                last.text = StringView{buffer}.substr(start);
+                last_in_buffer = true;
+            }
+
+            buffer += text;
+            last.text = {last.text.data(), last.text.size() + text.size()};
+        }
+
         void operator()(const Span& sp) {
-            // Apply normalisation to code spans.
+            StringView text = p->input.substr(sp.start, sp.size());
+
+            // Code spans are normalised in the same way as in Print(), and
+            // likewise never emitted in part.
             if (sp.is_code) {
-                // First, line endings are converted to spaces.
-                auto normalised = std::string{p->input.substr(sp.start, sp.size())};
-                for (auto& c : normalised)
-                    if (c == '\n')
-                        c = ' ';
-
-                // If the resulting string both begins and ends with a space character,
-                // but does not consist entirely of space characters, a single space
-                // character is removed from the front and back. This allows you to include
-                // code that begins or ends with backtick characters, which must be separated
-                // by whitespace from the opening or closing backtick strings.
-                if (
-                    normalised.size() > 2 and
-                    normalised.front() == ' ' and
-                    normalised.back() == ' ' and
-                    normalised.find_first_not_of(' ') != std::string::npos
-                ) {
-                    normalised.erase(normalised.begin());
-                    normalised.pop_back();
+                text = NormaliseCodeSpan(text);
+                usz size = 0;
+                p->ReplaceInvalid(text, [&](StringView piece, bool) { size += piece.size(); });
+                if (not Fits(size)) return;
+                auto saved = style;
+                style |= StyleRun::Code;
+                for (;;) {
+                    auto nl = text.find('\n');
+                    Append(text.substr(0, nl));
+                    if (nl == StringView::npos) break;
+                    Char space = ' ';
+                    emitted++;
+                    AppendToBuffer({&space, 1});
+                    text.remove_prefix(nl + 1);
                 }
 
-                // That’s all for code spans.
-                s += fmt::format("<code>{}</code>", normalised);
+                style = saved;
+                return;
+            }
+
+            // Regular text; process escapes. The escaped character is part of the
+            // input, so we only need to drop the backslash.
+            usz pos = 0;
+            usz start_of_text = 0;
+            for (;;) {
+                auto backslash = text.find('\\', pos);
+                if (backslash == StringView::npos or backslash == text.size() - 1) {
+                    Append(text.substr(start_of_text));
+                    return;
+                }
+
+                if (IsEscapable(text[backslash + 1])) {
+                    Append(text.substr(start_of_text, backslash - start_of_text));
+                    start_of_text = backslash + 1;
+                }
+
+                pos = backslash + 2;
+            }
+        }
+
+        void operator()(const Emph& e) {
+            auto saved = style;
+            switch (e.kind) {
+                case Emph::Kind::Bold: style |= StyleRun::Bold; break;
+                case Emph::Kind::Italic: style |= StyleRun::Italic; break;
+                case Emph::Kind::Underline: style |= StyleRun::Underline; break;
+                case Emph::Kind::Strikethrough: style |= StyleRun::Strikethrough; break;
+                case Emph::Kind::Spoiler: style |= StyleRun::Spoiler; break;
+            }
+
+            for (auto& n : e.nodes) std::visit(*this, n);
+            style = saved;
+        }
+    };
+
+    Printer p{this, runs, buffer};
+    for (auto& n : nodes) std::visit(p, n);
+    status.output_bytes_exceeded = p.truncated;
+}
+
+template <typename CharType>
+template <typename Out>
+void BasicParser<CharType>::PrintTo(Out& out) {
+    struct Printer {
+        BasicParser* p;
+        Out& s;
+
+        // Size of the closing tags of all elements that are currently open; we
+        // always need to be able to emit those.
+        usz reserved = 0;
+        bool truncated = false;
+
+        // Check whether we can emit this many more characters without going over
+        // the output limit; once we can’t, we stop emitting anything but closing tags.
+        bool Fits(usz chars) {
+            if (truncated) return false;
+            if ((s.size() + chars + reserved) * sizeof(Char) <= p->limits.max_output_bytes) return true;
+            truncated = true;
+            return false;
+        }
+
+        void Append(StringView text) {
+            p->ReplaceInvalid(text, [&](StringView piece, bool) {
+                if (Fits(piece.size())) s += piece;
+            });
+        }
+
+        // Markup is always ASCII, so it can be appended to a string of any encoding.
+        void AppendMarkup(std::string_view markup) {
+            s.append(markup.begin(), markup.end());
+        }
+
+        void operator()(const Span& sp) {
+            // Apply normalisation to code spans. Don’t emit part of a code span.
+            if (sp.is_code) {
+                static constexpr std::string_view open = "<code>";
+                static constexpr std::string_view close = "</code>";
+                auto text = NormaliseCodeSpan(p->input.substr(sp.start, sp.size()));
+                usz size = 0;
+                p->ReplaceInvalid(text, [&](StringView piece, bool) { size += piece.size(); });
+                if (not Fits(open.size() + size + close.size())) return;
+                AppendMarkup(open);
+                p->ReplaceInvalid(text, [&](StringView piece, bool) {
+                    for (auto c : piece) s += c == '\n' ? Char(' ') : c;
+                });
+                AppendMarkup(close);
                 return;
             }
 
             // Regular text; process escapes.
-            static constexpr std::string_view escapable = "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
-            std::string_view text = p->input.substr(sp.start, sp.size());
+            StringView text = p->input.substr(sp.start, sp.size());
             usz pos = 0;
             usz start_of_text = 0;
             for (;;) {
                 auto backslash = text.find('\\', pos);
-                if (backslash == std::string::npos or backslash == text.size() - 1) {
-                    s += text.substr(start_of_text);
+                if (backslash == StringView::npos or backslash == text.size() - 1) {
+                    Append(text.substr(start_of_text));
                     return;
                 }
 
@@ -516,10 +1062,9 @@ inline auto Parser::Print() -> std::string {
                 //
                 // Any ASCII punctuation character may be backslash-escaped:
                 // Backslashes before other characters are treated as literal backslashes
-                char escaped = text[backslash + 1];
-                if (escapable.find(escaped) != std::string::npos) {
-                    s += text.substr(start_of_text, backslash - start_of_text);
-                    s += escaped;
+                if (IsEscapable(text[backslash + 1])) {
+                    Append(text.substr(start_of_text, backslash - start_of_text));
+                    Append(text.substr(backslash + 1, 1));
                     start_of_text = backslash + 2;
                 }
 
@@ -529,16 +1074,158 @@ inline auto Parser::Print() -> std::string {
         }
 
         void operator()(const Emph& e) {
-            s += fmt::format("<{}>", e.kind);
+            auto open = fmt::format("<{}>", e.kind);
+            auto close = fmt::format("</{}>", e.kind);
+            if (not Fits(open.size() + close.size())) return;
+            AppendMarkup(open);
+            reserved += close.size();
             for (auto& n : e.nodes) std::visit(*this, n);
-            s += fmt::format("</{}>", e.kind);
+            reserved -= close.size();
+            AppendMarkup(close);
         }
     };
 
-    Printer p{this};
+    out.clear();
+    Printer p{this, out};
     for (auto& n : nodes) std::visit(p, n);
-    return p.s;
+    status.output_bytes_exceeded = p.truncated;
+}
+
+template <typename CharType>
+bool BasicParser<CharType>::RejectIfInvalid() {
+    if (not status.invalid_encoding or on_invalid_encoding != OnInvalidEncoding::Reject) return false;
+
+    // Drop everything we’ve parsed so far; the output is empty.
+    nodes.clear();
+    delimiter_stack.erase(std::next(delimiter_stack.begin()), delimiter_stack.end());
+    return true;
+}
+
+template <typename CharType>
+constexpr auto BasicParser<CharType>::Replacement() -> StringView {
+    if constexpr (sizeof(Char) == 1) return "\xEF\xBF\xBD";
+    else return u"\uFFFD";
+}
+
+// Call `emit` on each piece of `text`, which must be part of the input, with
+// every invalid sequence replaced by U+FFFD; the second argument is true for
+// replacement characters.
+template <typename CharType>
+template <typename Callback>
+void BasicParser<CharType>::ReplaceInvalid(StringView text, Callback emit) {
+    if (invalid.empty()) {
+        emit(text, false);
+        return;
+    }
+
+    // Invalid sequences never contain ASCII characters, so they are never
+    // split across nodes, and a piece of text either contains all of an
+    // invalid sequence or none of it.
+    auto pos = usz(text.data() - input.data());
+    auto end = pos + text.size();
+    auto it = std::ranges::upper_bound(invalid, u32(pos), {}, &Span::end);
+    for (; it != invalid.end() and it->start < end; ++it) {
+        if (it->start > pos) emit(input.substr(pos, it->start - pos), false);
+        emit(Replacement(), true);
+        pos = it->end;
+    }
+
+    if (pos < end) emit(input.substr(pos, end - pos), false);
 }
 
+// Validate the input between `pos` and `end`. If `stop_at_delimiter` is set,
+// this also looks for the next delimiter, and returns its position, or npos
+// if there is none; the input is only validated up to that position.
+//
+// Looking for delimiters and validating at the same time means we only go
+// over the input once. For UTF-8, we check 8 bytes at a time: most text is
+// ASCII and contains few delimiters, so we can usually skip entire words.
+template <typename CharType>
+auto BasicParser<CharType>::Scan(usz pos, usz end, bool stop_at_delimiter) -> usz {
+    while (pos < end) {
+        if constexpr (sizeof(Char) == 1 and std::endian::native == std::endian::little) {
+            // Set the high bit of every byte that is equal to `c`.
+            static constexpr u64 Low = 0x7F7F7F7F7F7F7F7F;
+            static constexpr auto Matches = [](u64 word, char c) {
+                u64 x = word ^ (u64(u8(c)) * 0x0101010101010101);
+                return ~(((x & Low) + Low) | x | Low);
+            };
+
+            // Skip words that contain neither delimiters nor non-ASCII bytes.
+            while (end - pos >= sizeof(u64)) {
+                u64 word;
+                std::memcpy(&word, input.data() + pos, sizeof word);
+                u64 interesting = word & ~Low;
+                if (stop_at_delimiter) {
+                    interesting |= Matches(word, '*') | Matches(word, '_') | Matches(word, '~') |
+                                   Matches(word, '|') | Matches(word, '`');
+                }
+
+                if (interesting) {
+                    pos += usz(std::countr_zero(interesting)) / 8;
+                    break;
+                }
+
+                pos += sizeof(u64);
+            }
+
+            if (pos == end) break;
+        }
+
+        auto c = input[pos];
+        bool needs_validation = sizeof(Char) == 1 ? u8(c) >= 0x80 : (c >= 0xD800 and c <= 0xDFFF);
+        if (needs_validation) {
+            pos = ValidateSequence(pos, end);
+            continue;
+        }
+
+        if (stop_at_delimiter and (c == '*' or c == '_' or c == '~' or c == '|' or c == '`')) return pos;
+        pos++;
+    }
+
+    return StringView::npos;
+}
+
+// Check the sequence that starts with the non-ASCII code unit at `pos` (for
+// UTF-16, a surrogate) and return the position after it. If it is invalid,
+// record it and return the position after its maximal subpart, as defined
+// in Unicode §3.9, so that every maximal subpart becomes one U+FFFD.
+template <typename CharType>
+auto BasicParser<CharType>::ValidateSequence(usz pos, usz end) -> usz {
+    usz len = 1;
+    usz valid = 0;
+    if constexpr (sizeof(Char) == 1) {
+        // Table 3-7, Well-Formed UTF-8 Byte Sequences.
+        auto lead = u8(input[pos]);
+        u8 lo = 0x80, hi = 0xBF;
+        if (lead >= 0xC2 and lead <= 0xDF) valid = 2;
+        else if (lead >= 0xE0 and lead <= 0xEF) valid = 3;
+        else if (lead >= 0xF0 and lead <= 0xF4) valid = 4;
+        if (lead == 0xE0) lo = 0xA0;
+        else if (lead == 0xED) hi = 0x9F;
+        else if (lead == 0xF0) lo = 0x90;
+        else if (lead == 0xF4) hi = 0x8F;
+
+        // Consume continuation bytes for as long as they are valid.
+        while (len < valid and pos + len < end) {
+            auto c = u8(input[pos + len]);
+            if (c < lo or c > hi) break;
+            lo = 0x80;
+            hi = 0xBF;
+            len++;
+        }
+    } else {
+        valid = 2;
+        if (input[pos] <= 0xDBFF and pos + 1 < end and input[pos + 1] >= 0xDC00 and input[pos + 1] <= 0xDFFF)
+            len = 2;
+    }
+
+    if (len != valid) {
+        invalid.emplace_back(pos, pos + len);
+        status.invalid_encoding = true;
+    }
+
+    return pos + len;
+}
 
 #endif //PARSER_HH
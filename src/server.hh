@@ -0,0 +1,513 @@
+#ifndef MD_INLINE_PARSER_SERVER_HH
+#define MD_INLINE_PARSER_SERVER_HH
+
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <parser.hh>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Long-running server that renders messages for other processes on the
+// same host, so they neither have to link against the parser nor pay for
+// starting a process per message.
+//
+// The server listens on a Unix domain socket. Clients send requests and
+// receive responses, both framed as follows; all integers are little-endian:
+//
+//   u32  Size of the rest of the frame.
+//   u64  Request ID, chosen by the client; the response has the same ID.
+//   u8   Request type (see RequestType) or response status (see Status).
+//   ...  Payload: the UTF-8 text to render, or the rendered HTML. Invalid
+//        UTF-8 in the text is rendered as U+FFFD.
+//
+// Clients may send any number of requests without waiting for responses.
+// Requests are processed in batches by a pool of workers, so responses can
+// arrive in a different order than the requests were sent in. Once a client
+// has MaxRequestsPerConnection requests whose responses haven’t been sent yet,
+// e.g. because it isn’t reading them, we stop reading its requests until it
+// catches up; this only ever blocks the threads for that connection.
+struct Server {
+    using Clock = std::chrono::steady_clock;
+
+    enum struct RequestType : u8 {
+        Render = 0, // Render the payload as HTML.
+        Stats = 1,  // Return statistics about the server as text; no payload.
+    };
+
+    enum struct Status : u8 {
+        Ok = 0,
+        LimitExceeded = 1, // Rendered, but a parser limit was hit.
+        BadRequest = 2,    // Unknown request type; no payload.
+    };
+
+    static constexpr usz HeaderSize = sizeof(u32) + sizeof(u64) + sizeof(u8);
+    static constexpr u32 MaxFrameSize = 16 << 20;
+    static constexpr usz MaxBatchSize = 64;
+    static constexpr usz MaxQueuedRequests = 64 * 1024;
+    static constexpr usz MaxRequestsPerConnection = 1024;
+
+    // Every connection has a reader and a writer thread. Workers hand their
+    // responses to the writer instead of sending them themselves, so a client
+    // that doesn’t read its responses can’t block a worker.
+    struct Connection {
+        int fd;
+        std::mutex lock;
+        std::condition_variable output_ready;
+        std::condition_variable can_read;
+        std::string output;        // Responses that haven’t been sent yet.
+        usz responses = 0;         // Number of responses in `output`.
+        usz in_flight = 0;         // Requests that have been read, but whose response hasn’t been sent.
+        bool done_reading = false; // No more requests will be read.
+        bool failed = false;       // Sending failed; discard all further responses.
+
+        Connection(int fd) : fd{fd} {}
+        ~Connection() { close(fd); }
+        void Respond(std::string_view data, usz count);
+    };
+
+    struct Request {
+        std::shared_ptr<Connection> conn;
+        u64 id;
+        RequestType type;
+        std::string text;
+        Clock::time_point received;
+    };
+
+    // Log-linear histogram of latencies in microseconds; every power of two
+    // is split into 8 buckets, so values are accurate to within 12.5%.
+    class Histogram {
+        static constexpr usz SubBuckets = 8;
+        std::array<std::atomic<u64>, SubBuckets + 61 * SubBuckets> buckets{};
+
+        static auto Bucket(u64 value) -> usz;
+        static auto LowerBound(usz bucket) -> u64;
+
+    public:
+        void Record(u64 value) { buckets[Bucket(value)].fetch_add(1, std::memory_order_relaxed); }
+        auto Percentile(double p) -> u64;
+    };
+
+    std::string socket_path;
+    int listen_fd = -1;
+    Parser::Limits limits;
+    std::atomic<bool> stopping{};
+
+    std::mutex queue_lock;
+    std::condition_variable_any queue_not_empty;
+    std::condition_variable_any queue_not_full;
+    std::deque<Request> queue;
+
+    // Connections whose threads are still running.
+    std::mutex connections_lock;
+    std::condition_variable connections_closed;
+    std::vector<std::shared_ptr<Connection>> open_connections;
+
+    Clock::time_point started = Clock::now();
+    Histogram latency;
+    std::atomic<u64> requests{};
+    std::atomic<u64> bad_requests{};
+    std::atomic<u64> limits_exceeded{};
+    std::atomic<u64> bytes_in{};
+    std::atomic<u64> bytes_out{};
+    std::atomic<u64> connections{};
+
+    // This must come last so the workers are stopped before anything they use
+    // is destroyed.
+    std::vector<std::jthread> workers;
+
+    // Run() must have returned before a server is destroyed; call Stop() from
+    // another thread to make it return. The destructor closes all connections
+    // and waits for their threads to exit.
+    Server(std::string path, usz worker_count, Parser::Limits limits = {});
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+    ~Server();
+
+    void Enqueue(Connection& conn, std::vector<Request>& batch);
+    void Handle(std::shared_ptr<Connection> conn);
+    void Read(const std::shared_ptr<Connection>& conn);
+    void Run();
+    auto Stats() -> std::string;
+    void Stop();
+    void Work(std::stop_token stop);
+    void Write(Connection& conn);
+
+    static auto Read32(const char* data) -> u32;
+    static auto Read64(const char* data) -> u64;
+    static void WriteHeader(std::string& out, usz payload_size, u64 id, u8 type_or_status);
+};
+
+inline void Server::Connection::Respond(std::string_view data, usz count) {
+    std::unique_lock _{lock};
+    if (failed) {
+        in_flight -= count;
+        return;
+    }
+
+    output += data;
+    responses += count;
+    output_ready.notify_one();
+}
+
+inline auto Server::Histogram::Bucket(u64 value) -> usz {
+    if (value < SubBuckets) return usz(value);
+    auto msb = usz(std::bit_width(value)) - 1;
+    auto sub = usz(value >> (msb - 3)) & (SubBuckets - 1);
+    return SubBuckets + (msb - 3) * SubBuckets + sub;
+}
+
+inline auto Server::Histogram::LowerBound(usz bucket) -> u64 {
+    if (bucket < SubBuckets) return bucket;
+    auto msb = (bucket - SubBuckets) / SubBuckets + 3;
+    auto sub = (bucket - SubBuckets) % SubBuckets;
+    return u64(SubBuckets + sub) << (msb - 3);
+}
+
+inline auto Server::Histogram::Percentile(double p) -> u64 {
+    u64 total = 0;
+    for (auto& b : buckets) total += b.load(std::memory_order_relaxed);
+    if (total == 0) return 0;
+
+    // Find the bucket that contains the value at that rank.
+    auto rank = u64(std::ceil(p * double(total)));
+    u64 seen = 0;
+    for (usz i = 0; i < buckets.size(); i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) return LowerBound(i);
+    }
+
+    return LowerBound(buckets.size() - 1);
+}
+
+inline Server::Server(std::string path, usz worker_count, Parser::Limits limits)
+    : socket_path{std::move(path)}, limits{limits} {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) die("Socket path too long: '{}'", socket_path);
+    std::memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+
+    // Remove the socket left behind by a previous instance, if any. Never remove
+    // anything that isn’t a socket, or the socket of an instance that is still
+    // running; we can tell the latter apart because it accepts connections.
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0) {
+        if (not S_ISSOCK(st.st_mode)) die("'{}' exists and is not a socket", socket_path);
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) die("socket(): {}", std::strerror(errno));
+        int res = connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof addr);
+        int err = errno;
+        close(probe);
+        if (res == 0) die("Another server is already listening on '{}'", socket_path);
+        if (err != ECONNREFUSED) die("Cannot connect to '{}': {}", socket_path, std::strerror(err));
+        if (unlink(socket_path.c_str()) < 0) die("Cannot remove '{}': {}", socket_path, std::strerror(errno));
+    } else if (errno != ENOENT) {
+        die("Cannot stat '{}': {}", socket_path, std::strerror(errno));
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) die("socket(): {}", std::strerror(errno));
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0)
+        die("Cannot bind to '{}': {}", socket_path, std::strerror(errno));
+    if (listen(listen_fd, SOMAXCONN) < 0) die("listen(): {}", std::strerror(errno));
+
+    for (usz i = 0; i < std::max<usz>(worker_count, 1); i++)
+        workers.emplace_back([this](std::stop_token stop) { Work(stop); });
+}
+
+inline Server::~Server() {
+    Stop();
+
+    // Shut down all connections. Their threads exit once the workers have
+    // handled the requests that are already queued, which they still do since
+    // they are only stopped after this.
+    {
+        std::unique_lock lock{connections_lock};
+        for (auto& conn : open_connections) shutdown(conn->fd, SHUT_RDWR);
+        connections_closed.wait(lock, [&] { return open_connections.empty(); });
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+}
+
+inline void Server::Handle(std::shared_ptr<Connection> conn) {
+    connections++;
+    std::jthread writer{[this, conn] { Write(*conn); }};
+    Read(conn);
+
+    // Let the writer exit once it has sent the responses to all requests we’ve queued.
+    std::unique_lock _{conn->lock};
+    conn->done_reading = true;
+    conn->output_ready.notify_one();
+}
+
+inline void Server::Read(const std::shared_ptr<Connection>& conn) {
+    std::string buffer;
+    std::vector<Request> batch;
+    char chunk[64 * 1024];
+    for (;;) {
+        auto n = recv(conn->fd, chunk, sizeof chunk, 0);
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) break;
+        buffer.append(chunk, usz(n));
+        bytes_in += u64(n);
+
+        // Collect all complete requests that we’ve received so far.
+        auto now = Clock::now();
+        usz pos = 0;
+        while (buffer.size() - pos >= sizeof(u32)) {
+            // We can’t recover from a malformed frame, so drop the connection; any
+            // requests that are already queued still get a response.
+            auto size = Read32(buffer.data() + pos);
+            if (size < HeaderSize - sizeof(u32) or size > MaxFrameSize) {
+                bad_requests++;
+                Enqueue(*conn, batch);
+                return;
+            }
+
+            if (buffer.size() - pos - sizeof(u32) < size) break;
+            auto frame = buffer.data() + pos;
+            batch.push_back(Request{
+                .conn = conn,
+                .id = Read64(frame + sizeof(u32)),
+                .type = RequestType(frame[sizeof(u32) + sizeof(u64)]),
+                .text = std::string{frame + HeaderSize, size - (HeaderSize - sizeof(u32))},
+                .received = now,
+            });
+
+            pos += sizeof(u32) + size;
+        }
+
+        // And hand them to the workers all at once.
+        buffer.erase(0, pos);
+        Enqueue(*conn, batch);
+    }
+}
+
+inline void Server::Enqueue(Connection& conn, std::vector<Request>& batch) {
+    for (usz i = 0; i < batch.size();) {
+        // Wait until this connection is allowed to have more requests in flight.
+        usz n;
+        {
+            std::unique_lock lock{conn.lock};
+            conn.can_read.wait(lock, [&] { return conn.in_flight < MaxRequestsPerConnection or conn.failed; });
+            if (conn.failed) break;
+            n = std::min(batch.size() - i, MaxRequestsPerConnection - conn.in_flight);
+            conn.in_flight += n;
+        }
+
+        {
+            std::unique_lock lock{queue_lock};
+            queue_not_full.wait(lock, [&] { return queue.size() < MaxQueuedRequests; });
+            for (usz j = i; j < i + n; j++) queue.push_back(std::move(batch[j]));
+        }
+
+        if (n == 1) queue_not_empty.notify_one();
+        else queue_not_empty.notify_all();
+        i += n;
+    }
+
+    batch.clear();
+}
+
+inline void Server::Run() {
+    fmt::print(stderr, "Listening on '{}' with {} workers\n", socket_path, workers.size());
+    for (;;) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (stopping) return;
+            if (errno == EINTR or errno == ECONNABORTED) continue;
+            die("accept(): {}", std::strerror(errno));
+        }
+
+        // The connection is tracked until its thread exits, so the destructor can wait for it.
+        auto conn = std::make_shared<Connection>(fd);
+        std::unique_lock _{connections_lock};
+        if (stopping) return;
+        open_connections.push_back(conn);
+        std::thread{[this, conn] {
+            Handle(conn);
+            std::unique_lock _{connections_lock};
+            std::erase(open_connections, conn);
+            connections_closed.notify_all();
+        }}.detach();
+    }
+}
+
+inline auto Server::Stats() -> std::string {
+    auto uptime = std::chrono::duration<double>(Clock::now() - started).count();
+    return fmt::format(
+        "uptime_seconds {:.3f}\n"
+        "connections {}\n"
+        "requests {}\n"
+        "requests_per_second {:.1f}\n"
+        "bad_requests {}\n"
+        "limits_exceeded {}\n"
+        "bytes_in {}\n"
+        "bytes_out {}\n"
+        "latency_p50_us {}\n"
+        "latency_p99_us {}\n"
+        "latency_p999_us {}\n",
+        uptime,
+        connections.load(),
+        requests.load(),
+        double(requests.load()) / uptime,
+        bad_requests.load(),
+        limits_exceeded.load(),
+        bytes_in.load(),
+        bytes_out.load(),
+        latency.Percentile(.5),
+        latency.Percentile(.99),
+        latency.Percentile(.999)
+    );
+}
+
+inline void Server::Stop() {
+    // Shutting down the listening socket makes accept() fail.
+    if (stopping.exchange(true)) return;
+    shutdown(listen_fd, SHUT_RDWR);
+}
+
+inline void Server::Work(std::stop_token stop) {
+    std::vector<Request> batch;
+    std::string out;
+    for (;;) {
+        {
+            std::unique_lock lock{queue_lock};
+            if (not queue_not_empty.wait(lock, stop, [&] { return not queue.empty(); })) return;
+            while (not queue.empty() and batch.size() < MaxBatchSize) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+        }
+
+        queue_not_full.notify_all();
+
+        // Requests in a batch usually come from the same connection; send all
+        // responses for a connection at once.
+        for (usz i = 0; i < batch.size();) {
+            auto& conn = batch[i].conn;
+            usz end = i;
+            out.clear();
+            for (; end < batch.size() and batch[end].conn == conn; end++) {
+                auto& r = batch[end];
+                switch (r.type) {
+                    case RequestType::Render: {
+                        Parser p{r.text, limits};
+                        auto html = p.PrintInline();
+                        auto status = p.status.limit_exceeded() ? Status::LimitExceeded : Status::Ok;
+                        if (status == Status::LimitExceeded) limits_exceeded++;
+                        WriteHeader(out, html.size(), r.id, u8(status));
+                        out += html;
+                    } break;
+
+                    case RequestType::Stats: {
+                        auto stats = Stats();
+                        WriteHeader(out, stats.size(), r.id, u8(Status::Ok));
+                        out += stats;
+                    } break;
+
+                    default:
+                        bad_requests++;
+                        WriteHeader(out, 0, r.id, u8(Status::BadRequest));
+                        break;
+                }
+            }
+
+            // Record how long each request took, from receiving it to handing the
+            // response to the writer; a client that is slow to read its responses
+            // shouldn’t affect this. Do this first so the stats are up to date by
+            // the time the client gets the responses.
+            auto now = Clock::now();
+            for (usz j = i; j < end; j++) {
+                latency.Record(u64(std::chrono::duration_cast<std::chrono::microseconds>(now - batch[j].received).count()));
+                requests++;
+            }
+
+            conn->Respond(out, end - i);
+            i = end;
+        }
+
+        batch.clear();
+    }
+}
+
+inline void Server::Write(Connection& conn) {
+    std::string data;
+    for (;;) {
+        usz count;
+        {
+            std::unique_lock lock{conn.lock};
+            conn.output_ready.wait(lock, [&] {
+                return not conn.output.empty() or (conn.done_reading and conn.in_flight == 0);
+            });
+
+            if (conn.output.empty()) return;
+            std::swap(data, conn.output);
+            count = std::exchange(conn.responses, 0);
+        }
+
+        bool sent = true;
+        for (std::string_view rest = data; not rest.empty();) {
+            auto n = send(conn.fd, rest.data(), rest.size(), MSG_NOSIGNAL);
+            if (n < 0 and errno == EINTR) continue;
+            if (n <= 0) {
+                sent = false;
+                break;
+            }
+
+            bytes_out += u64(n);
+            rest.remove_prefix(usz(n));
+        }
+
+        {
+            std::unique_lock _{conn.lock};
+            conn.in_flight -= count;
+            conn.failed = not sent;
+            conn.can_read.notify_one();
+        }
+
+        // If the client has gone away, there is nothing we can do; stop reading
+        // its requests too.
+        if (not sent) {
+            shutdown(conn.fd, SHUT_RDWR);
+            return;
+        }
+
+        data.clear();
+    }
+}
+
+inline auto Server::Read32(const char* data) -> u32 {
+    u32 value = 0;
+    for (usz i = 0; i < sizeof(u32); i++) value |= u32(u8(data[i])) << (8 * i);
+    return value;
+}
+
+inline auto Server::Read64(const char* data) -> u64 {
+    u64 value = 0;
+    for (usz i = 0; i < sizeof(u64); i++) value |= u64(u8(data[i])) << (8 * i);
+    return value;
+}
+
+inline void Server::WriteHeader(std::string& out, usz payload_size, u64 id, u8 type_or_status) {
+    auto size = u32(HeaderSize - sizeof(u32) + payload_size);
+    for (usz i = 0; i < sizeof(u32); i++) out += char(u8(size >> (8 * i)));
+    for (usz i = 0; i < sizeof(u64); i++) out += char(u8(id >> (8 * i)));
+    out += char(type_or_status);
+}
+
+#endif // MD_INLINE_PARSER_SERVER_HH
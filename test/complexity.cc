@@ -0,0 +1,221 @@
+#include <catch2/catch_all.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <parser.hh>
+
+// Worst-case inputs at growing sizes. Each family of adversarial inputs is
+// generated at sizes from 1K to 1M bytes; we measure the time it takes to parse
+// and print each input, as well as the peak memory used while doing so, fit a
+// line to the measurements on a log-log scale, and fail if the slope of that
+// line, i.e. the exponent of the growth, exceeds 1 by more than a tolerance.
+//
+// Timings are only meaningful in an optimised build, which is why this is a
+// separate target from the other tests.
+
+// ============================================================================
+//  Memory tracking.
+// ============================================================================
+// Keep track of the number of bytes currently allocated. Every allocation is
+// preceded by a header that stores its size, so we know how much is freed.
+static usz current_bytes = 0;
+static usz peak_bytes = 0;
+
+static auto Allocate(usz size, usz align) -> void* {
+    align = std::max(align, alignof(std::max_align_t));
+    auto base = static_cast<char*>(std::aligned_alloc(align, (size + 2 * align - 1) / align * align));
+    if (not base) return nullptr;
+    std::memcpy(base + align - sizeof size, &size, sizeof size);
+    current_bytes += size;
+    peak_bytes = std::max(peak_bytes, current_bytes);
+    return base + align;
+}
+
+static void Deallocate(void* ptr, usz align) {
+    if (not ptr) return;
+    align = std::max(align, alignof(std::max_align_t));
+    auto base = static_cast<char*>(ptr) - align;
+    usz size;
+    std::memcpy(&size, base + align - sizeof size, sizeof size);
+    current_bytes -= size;
+    std::free(base);
+}
+
+// Every form of operator new and delete must go through these; anything that
+// we don’t replace doesn’t have the header, which delete relies on.
+static auto AllocateOrThrow(usz size, usz align) -> void* {
+    if (auto ptr = Allocate(size, align)) return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new(usz size) { return AllocateOrThrow(size, 0); }
+void* operator new(usz size, std::align_val_t align) { return AllocateOrThrow(size, usz(align)); }
+void* operator new(usz size, const std::nothrow_t&) noexcept { return Allocate(size, 0); }
+void* operator new(usz size, std::align_val_t align, const std::nothrow_t&) noexcept { return Allocate(size, usz(align)); }
+void operator delete(void* ptr) noexcept { Deallocate(ptr, 0); }
+void operator delete(void* ptr, usz) noexcept { Deallocate(ptr, 0); }
+void operator delete(void* ptr, std::align_val_t align) noexcept { Deallocate(ptr, usz(align)); }
+void operator delete(void* ptr, usz, std::align_val_t align) noexcept { Deallocate(ptr, usz(align)); }
+
+// ============================================================================
+//  Measurements.
+// ============================================================================
+using Generator = std::function<std::string(usz size)>;
+
+// Maximum exponent of the growth of time and memory, respectively. Time is
+// noisy, and caches make large inputs a bit slower per byte than small ones,
+// so allow more leeway there; anything quadratic, or even n log n with a
+// large constant, is still well above this.
+static constexpr double TimeTolerance = .3;
+static constexpr double MemoryTolerance = .15;
+
+struct Measurement {
+    usz size;
+    double seconds;
+    usz bytes;
+};
+
+// Parse and print an input, and return the best time out of several runs, as
+// well as the peak memory used, excluding the input and the parser object
+// itself; the latter is a few KiB regardless of the input, which would flatten
+// the growth we’re trying to measure for small inputs.
+//
+// We measure CPU time rather than wall-clock time so other processes running
+// at the same time affect the results as little as possible. Small inputs are
+// parsed several times per sample so that each sample is long enough to be
+// measured accurately.
+static auto Measure(std::string_view input) -> Measurement {
+    static constexpr double MinSampleSeconds = .002;
+    static constexpr double MinSeconds = .05;
+    static constexpr usz MinSamples = 5;
+    static constexpr auto Seconds = [](std::clock_t c) { return double(c) / CLOCKS_PER_SEC; };
+
+    Measurement m{input.size(), std::numeric_limits<double>::infinity(), 0};
+    auto Run = [&] {
+        auto baseline = peak_bytes = current_bytes;
+        {
+            auto p = std::make_unique<Parser>(input);
+            auto s = p->Print();
+            REQUIRE(not s.empty());
+        }
+        m.bytes = peak_bytes - baseline - sizeof(Parser);
+    };
+
+    // Figure out how many runs we need per sample.
+    usz runs = 1;
+    for (;;) {
+        auto start = std::clock();
+        for (usz i = 0; i < runs; i++) Run();
+        if (Seconds(std::clock() - start) >= MinSampleSeconds) break;
+        runs *= 2;
+    }
+
+    auto started = std::clock();
+    for (usz samples = 0; samples < MinSamples or Seconds(std::clock() - started) < MinSeconds; samples++) {
+        auto start = std::clock();
+        for (usz i = 0; i < runs; i++) Run();
+        m.seconds = std::min(m.seconds, Seconds(std::clock() - start) / double(runs));
+    }
+
+    return m;
+}
+
+// Least-squares fit of log(y) = a + b * log(x); returns b.
+static auto Exponent(const std::vector<Measurement>& ms, auto proj) -> double {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (auto& m : ms) {
+        auto x = std::log(double(m.size));
+        auto y = std::log(double(std::invoke(proj, m)));
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    auto n = double(ms.size());
+    return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+static void CheckScaling(std::string_view name, const Generator& generate) {
+    std::vector<Measurement> ms;
+    std::string table;
+    for (usz size = 1 << 10; size <= 1 << 20; size <<= 2) {
+        auto input = generate(size);
+        auto& m = ms.emplace_back(Measure(input));
+        table += fmt::format("{:>8} bytes: {:>10.3f} ms, {:>10} bytes of memory\n", m.size, m.seconds * 1e3, m.bytes);
+    }
+
+    auto time = Exponent(ms, &Measurement::seconds);
+    auto memory = Exponent(ms, &Measurement::bytes);
+    INFO(fmt::format("{}:\n{}Time grows with exponent {:.2f}, memory with exponent {:.2f}", name, table, time, memory));
+    CHECK(time <= 1 + TimeTolerance);
+    CHECK(memory <= 1 + MemoryTolerance);
+}
+
+// ============================================================================
+//  Generators.
+// ============================================================================
+// Repeat `s` until we reach `size` bytes.
+static auto Fill(std::string_view s, usz size) -> std::string {
+    std::string out;
+    out.reserve(size + s.size());
+    while (out.size() < size) out += s;
+    return out;
+}
+
+// Repeat `prefix` and then `suffix` so that both take up half of `size` bytes.
+static auto Fill(std::string_view prefix, std::string_view suffix, usz size) -> std::string {
+    return Fill(prefix, size / 2) + Fill(suffix, size / 2);
+}
+
+TEST_CASE("Unmatched backtick ladders") {
+    // Backtick strings of every length, none of which have a closer.
+    CheckScaling("Ladder", [](usz size) {
+        std::string s;
+        for (usz i = 1; s.size() < size; i++) s += std::string(i, '`') + " a ";
+        return s;
+    });
+
+    // The same, but longest first.
+    CheckScaling("Descending ladder", [](usz size) {
+        std::string s;
+        usz i = 1;
+        while (i * (i + 1) / 2 + 3 * i < size) i++;
+        for (; i > 0; i--) s += std::string(i, '`') + " a ";
+        return s;
+    });
+
+    // Single backticks before longer backtick strings that never close them.
+    CheckScaling("Single backticks", [](usz size) { return Fill("`a", "``a ```b ", size); });
+}
+
+TEST_CASE("Interleaved delimiter kinds") {
+    CheckScaling("Openers, then mixed closers", [](usz size) { return Fill("_a ", "~~a a* a~~ ", size); });
+    CheckScaling("Mismatched openers and closers", [](usz size) { return Fill("*a_ ", size); });
+    CheckScaling("All kinds", [](usz size) { return Fill("*a _a ~~a ||a __a ", "a* a_ a~~ a|| a** ", size); });
+}
+
+TEST_CASE("Deep nesting") {
+    CheckScaling("Emphasis", [](usz size) { return Fill("*a ", " a*", size); });
+    CheckScaling("Strong emphasis", [](usz size) { return Fill("**a ", " a**", size); });
+    CheckScaling("Different kinds", [](usz size) { return Fill("*a _a ~~a ||a ", " a|| a~~ a_ a*", size); });
+}
+
+TEST_CASE("Long backslash runs") {
+    CheckScaling("Before a delimiter", [](usz size) { return Fill("\\", size) + "*a*"; });
+    CheckScaling("Alternating", [](usz size) { return Fill("\\*", size); });
+    CheckScaling("Escaped delimiters", [](usz size) { return Fill("\\\\\\*a", size); });
+}
+
+TEST_CASE("Rule of three traps") {
+    // Closers that can’t close the opener because of the rule of three.
+    CheckScaling("Multiple of 3", [](usz size) { return "a**b" + Fill("c* ", size); });
+    CheckScaling("Closers, then openers", [](usz size) { return Fill("a* ", "**a ", size); });
+    CheckScaling("Both", [](usz size) { return Fill("a*b**c ", size); });
+}
@@ -0,0 +1,297 @@
+#include <catch2/catch_all.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <poll.h>
+#include <server.hh>
+#include <set>
+#include <sstream>
+#include <unistd.h>
+
+static constexpr Parser::Limits TestLimits{.max_output_bytes = 1024};
+static auto TempSocketPath(std::string_view name) -> std::string {
+    auto file = fmt::format("md-inline-parser-{}-{}.sock", name, getpid());
+    return (std::filesystem::temp_directory_path() / file).string();
+}
+
+// A server that runs in the background until it is destroyed.
+struct TestServer {
+    Server server;
+    std::jthread runner{[this] { server.Run(); }};
+
+    TestServer(std::string path) : server{std::move(path), 2, TestLimits} {}
+    ~TestServer() {
+        server.Stop();
+        runner.join();
+    }
+};
+
+// Most tests share a server that runs until the process exits.
+static auto SocketPath() -> const std::string& {
+    static TestServer shared{TempSocketPath("test")};
+    return shared.server.socket_path;
+}
+
+struct Response {
+    u64 id;
+    Server::Status status;
+    std::string payload;
+};
+
+struct Client {
+    static constexpr int Timeout = 5'000;
+    int fd;
+
+    Client(const std::string& path = SocketPath()) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.data(), path.size());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        REQUIRE(fd >= 0);
+        REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0);
+    }
+
+    ~Client() { close(fd); }
+
+    static auto Frame(u64 id, Server::RequestType type, std::string_view payload) -> std::string {
+        std::string out;
+        Server::WriteHeader(out, payload.size(), id, u8(type));
+        out += payload;
+        return out;
+    }
+
+    void Send(std::string_view data) {
+        while (not data.empty()) {
+            auto n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            REQUIRE(n > 0);
+            data.remove_prefix(usz(n));
+        }
+    }
+
+    void Send(u64 id, Server::RequestType type, std::string_view payload = "") {
+        Send(Frame(id, type, payload));
+    }
+
+    // Read exactly `size` bytes; returns false if the server closed the connection.
+    bool ReadExactly(char* data, usz size) {
+        while (size) {
+            pollfd p{fd, POLLIN, 0};
+            REQUIRE(poll(&p, 1, Timeout) == 1);
+            auto n = recv(fd, data, size, 0);
+            if (n == 0) return false;
+            REQUIRE(n > 0);
+            data += n;
+            size -= usz(n);
+        }
+        return true;
+    }
+
+    auto Receive() -> std::optional<Response> {
+        char header[Server::HeaderSize];
+        if (not ReadExactly(header, sizeof header)) return std::nullopt;
+        Response r{
+            .id = Server::Read64(header + sizeof(u32)),
+            .status = Server::Status(header[sizeof(u32) + sizeof(u64)]),
+            .payload = std::string(Server::Read32(header) - (Server::HeaderSize - sizeof(u32)), '\0'),
+        };
+
+        REQUIRE(ReadExactly(r.payload.data(), r.payload.size()));
+        return r;
+    }
+
+    auto Render(std::string_view text) -> Response {
+        Send(0, Server::RequestType::Render, text);
+        auto r = Receive();
+        REQUIRE(r.has_value());
+        return *r;
+    }
+
+    auto Stats() -> std::map<std::string, double> {
+        Send(0, Server::RequestType::Stats);
+        auto r = Receive();
+        REQUIRE(r.has_value());
+        REQUIRE(r->status == Server::Status::Ok);
+
+        std::map<std::string, double> stats;
+        std::istringstream in{r->payload};
+        std::string key;
+        double value;
+        while (in >> key >> value) stats[key] = value;
+        return stats;
+    }
+};
+
+TEST_CASE("Server: Responses are matched by ID") {
+    // Send the requests from another thread, since the server stops reading
+    // requests from a client that isn’t reading its responses.
+    static constexpr u64 N = 5'000;
+    Client c;
+    std::string requests;
+    for (u64 i = 0; i < N; i++) {
+        auto id = (i * 7919) % N + 1'000;
+        requests += Client::Frame(id, Server::RequestType::Render, fmt::format("*{}* **b**", id));
+    }
+
+    std::jthread sender{[&] { c.Send(requests); }};
+    std::set<u64> seen;
+    for (u64 i = 0; i < N; i++) {
+        auto r = c.Receive();
+        REQUIRE(r.has_value());
+        INFO(r->id);
+        CHECK(r->status == Server::Status::Ok);
+        CHECK(r->payload == fmt::format("<em>{}</em> <strong>b</strong>", r->id));
+        CHECK(seen.insert(r->id).second);
+    }
+
+    CHECK(seen.size() == N);
+    CHECK(*seen.begin() == 1'000);
+    CHECK(*seen.rbegin() == N + 1'000 - 1);
+}
+
+TEST_CASE("Server: Responses can arrive out of order") {
+    // While one worker is busy with a large request, the other one handles a
+    // small request that we send after it. Wait a bit between the two, so the
+    // server doesn’t read them at the same time and give both to the same
+    // worker; if the large request still finishes first, try again.
+    std::string large;
+    while (large.size() < 2 << 20) large += "*a _b ";
+
+    Client c;
+    std::vector<u64> sent, arrived;
+    for (u64 attempt = 0, id = 0; attempt < 10 and arrived == sent; attempt++) {
+        sent = {id + 1, id + 2};
+        arrived.clear();
+        c.Send(++id, Server::RequestType::Render, large);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1 << attempt));
+        c.Send(++id, Server::RequestType::Render, "*a*");
+        for (usz i = 0; i < sent.size(); i++) {
+            auto r = c.Receive();
+            REQUIRE(r.has_value());
+            arrived.push_back(r->id);
+        }
+
+        // Responses can come in any order, but there is one for every request.
+        CHECK(std::set(arrived.begin(), arrived.end()) == std::set(sent.begin(), sent.end()));
+    }
+
+    CHECK(arrived != sent);
+}
+
+TEST_CASE("Server: Status codes") {
+    Client c;
+
+    SECTION("Unknown request types are rejected") {
+        c.Send(42, Server::RequestType(7));
+        auto r = c.Receive();
+        REQUIRE(r.has_value());
+        CHECK(r->id == 42);
+        CHECK(r->status == Server::Status::BadRequest);
+        CHECK(r->payload.empty());
+
+        // The connection can still be used.
+        CHECK(c.Render("*a*").payload == "<em>a</em>");
+    }
+
+    SECTION("Limits") {
+        auto r = c.Render(std::string(2'000, 'a'));
+        CHECK(r.status == Server::Status::LimitExceeded);
+        CHECK(r.payload.size() <= TestLimits.max_output_bytes);
+    }
+
+    SECTION("Invalid UTF-8 is replaced") {
+        auto r = c.Render("*\xFF*");
+        CHECK(r.status == Server::Status::Ok);
+        CHECK(r.payload == "<em>\uFFFD</em>");
+    }
+}
+
+TEST_CASE("Server: Malformed frames") {
+    // Requests before the malformed frame still get a response.
+    Client c;
+    std::string data = Client::Frame(1, Server::RequestType::Render, "*a*");
+    data += Client::Frame(2, Server::RequestType::Render, "*b*");
+    data += std::string(sizeof(u32), '\0');
+    c.Send(data);
+
+    std::set<u64> ids;
+    while (auto r = c.Receive()) ids.insert(r->id);
+    CHECK(ids == std::set<u64>{1, 2});
+}
+
+TEST_CASE("Server: Stats") {
+    Client c;
+    auto before = c.Stats();
+    c.Render("*a*");
+    c.Render(std::string(2'000, 'a'));
+    c.Send(0, Server::RequestType(7));
+    REQUIRE(c.Receive().has_value());
+    auto after = c.Stats();
+
+    // The first stats request counts as well.
+    CHECK(after["requests"] - before["requests"] == 4);
+    CHECK(after["bad_requests"] - before["bad_requests"] == 1);
+    CHECK(after["limits_exceeded"] - before["limits_exceeded"] == 1);
+    CHECK(after["bytes_in"] > before["bytes_in"]);
+    CHECK(after["bytes_out"] > before["bytes_out"]);
+    CHECK(after["connections"] >= 1);
+    CHECK(after["latency_p50_us"] <= after["latency_p99_us"]);
+    CHECK(after["latency_p99_us"] <= after["latency_p999_us"]);
+}
+
+TEST_CASE("Server: Latency histogram") {
+    Server::Histogram h;
+    CHECK(h.Percentile(.5) == 0);
+
+    for (u64 i = 1; i <= 1'000; i++) h.Record(i);
+    CHECK(h.Percentile(.5) <= 500);
+    CHECK(h.Percentile(.5) > 500 * 7 / 8);
+    CHECK(h.Percentile(.99) <= 990);
+    CHECK(h.Percentile(.99) > 990 * 7 / 8);
+    CHECK(h.Percentile(1) <= 1'000);
+    CHECK(h.Percentile(1) > 1'000 * 7 / 8);
+}
+
+TEST_CASE("Server: Destroying a server closes its connections") {
+    auto path = TempSocketPath("stop");
+    std::optional<TestServer> server{std::in_place, path};
+    Client c{path};
+    CHECK(c.Render("*a*").payload == "<em>a</em>");
+
+    // Leave some requests in flight; this must not keep the server from
+    // shutting down, and the client sees the connection close.
+    std::string data;
+    for (u64 i = 0; i < 100; i++) data += Client::Frame(i, Server::RequestType::Render, "*a*");
+    c.Send(data);
+    server.reset();
+
+    usz responses = 0;
+    while (c.Receive()) responses++;
+    CHECK(responses <= 100);
+    CHECK(not std::filesystem::exists(path));
+}
+
+// This leaves requests in flight, so it should run last.
+TEST_CASE("Server: A client that doesn’t read its responses doesn’t stall others") {
+    // Send as many requests as the server accepts without reading any responses.
+    Client slow;
+    std::string data;
+    for (usz i = 0; i < 1'000; i++) data += Client::Frame(i, Server::RequestType::Render, "*a* *b* *c* *d* *e*");
+    for (usz stalled = 0; stalled < 20;) {
+        auto n = send(slow.fd, data.data(), data.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 and errno == EAGAIN) {
+            stalled++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        REQUIRE(n > 0);
+        stalled = 0;
+    }
+
+    // Other clients still get a response.
+    Client c;
+    CHECK(c.Render("*a*").payload == "<em>a</em>");
+    CHECK(c.Stats()["requests"] >= Server::MaxRequestsPerConnection);
+}
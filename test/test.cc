@@ -4,11 +4,59 @@
 
 using namespace Catch::literals;
 
+// Count heap allocations so we can check that short messages don’t need any.
+//
+// All of these go through the same out-of-line pair of functions; otherwise,
+// GCC inlines them and complains that we’re calling free() on memory from new.
+static usz allocations = 0;
+
+[[gnu::noinline]] static auto Allocate(usz size) -> void* {
+    allocations++;
+    return std::malloc(size);
+}
+
+[[gnu::noinline]] static void Deallocate(void* ptr) { std::free(ptr); }
+
+void* operator new(usz size) {
+    if (auto ptr = Allocate(size)) return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new(usz size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void operator delete(void* ptr) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, usz) noexcept { Deallocate(ptr); }
+
 auto P(std::string_view input) -> std::string {
     return Parser(input).Print();
 }
 
-#define T(input, expected) CHECK(P(input) == expected)
+auto P16(std::u16string_view input) -> std::u16string {
+    return Parser16(input).Print();
+}
+
+auto Utf16(std::string_view utf8) -> std::u16string {
+    std::u16string out;
+    for (usz i = 0; i < utf8.size();) {
+        auto c = u8(utf8[i]);
+        usz len = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        char32_t cp = len == 1 ? c : len == 2 ? c & 0x1F : len == 3 ? c & 0x0F : c & 0x07;
+        for (usz j = 1; j < len; j++) cp = (cp << 6) | (u8(utf8[i + j]) & 0x3F);
+        if (cp < 0x10000) out += char16_t(cp);
+        else {
+            out += char16_t(0xD800 + ((cp - 0x10000) >> 10));
+            out += char16_t(0xDC00 + ((cp - 0x10000) & 0x3FF));
+        }
+        i += len;
+    }
+    return out;
+}
+
+// Check every input both as UTF-8 and as UTF-16.
+#define T(input, expected)                              \
+    do {                                                \
+        CHECK(P(input) == expected);                    \
+        CHECK(P16(Utf16(input)) == Utf16(expected));    \
+    } while (false)
 
 TEST_CASE("Empty string doesn’t crash") {
     T("", "");
@@ -239,4 +287,343 @@ TEST_CASE("Spoiler extension") {
     T("**foo ||bar|| baz**", "<strong>foo <spoiler>bar</spoiler> baz</strong>");
     T("||foo\nbar||", "<spoiler>foo\nbar</spoiler>");
     T("||t|\\|e\\||v||", "<spoiler>t||e||v</spoiler>");
-}
\ No newline at end of file
+}
+
+auto Repeat(std::string_view s, usz n) -> std::string {
+    std::string out;
+    out.reserve(s.size() * n);
+    for (usz i = 0; i < n; i++) out += s;
+    return out;
+}
+
+auto Count(std::string_view haystack, std::string_view needle) -> usz {
+    usz n = 0;
+    for (auto pos = haystack.find(needle); pos != std::string::npos; pos = haystack.find(needle, pos + 1)) n++;
+    return n;
+}
+
+auto CountNodes(const Parser::NodeList& nodes) -> usz {
+    usz n = nodes.size();
+    for (auto& node : nodes)
+        if (auto e = std::get_if<Parser::Emph>(&node))
+            n += CountNodes(e->nodes);
+    return n;
+}
+
+TEST_CASE("Default limits don’t affect regular input") {
+    Parser p{"*foo **bar *baz* bim** bop* `code` ~~x~~ ||y||"};
+    CHECK(p.status.ok());
+    p.Print();
+    CHECK(p.status.ok());
+}
+
+TEST_CASE("Nesting depth limit") {
+    constexpr usz N = 10'000;
+    auto input = Repeat("*a ", N) + "x" + Repeat(" a*", N);
+    Parser p{input, {.max_nesting_depth = 10}};
+    auto s = p.Print();
+    CHECK(p.status.nesting_depth_exceeded);
+    CHECK(Count(s, "<em>") == 10);
+    CHECK(Count(s, "</em>") == 10);
+    CHECK(s.starts_with(Repeat("*a ", N - 10)));
+    CHECK(s.ends_with(Repeat(" a*", N - 10)));
+
+    // The default limit still allows some nesting, but not arbitrarily much.
+    Parser q{input};
+    auto t = q.Print();
+    CHECK(q.status.nesting_depth_exceeded);
+    CHECK(Count(t, "<em>") == Parser::Limits{}.max_nesting_depth);
+}
+
+TEST_CASE("Delimiter limit") {
+    constexpr usz N = 10'000;
+    auto input = Repeat("*a* ", N);
+    Parser p{input, {.max_delimiters = 100}};
+    auto s = p.Print();
+    CHECK(p.status.delimiters_exceeded);
+    CHECK(p.delimiter_stack.size() <= 101);
+    CHECK(Count(s, "<em>") == 50);
+    CHECK(s.ends_with(Repeat("*a* ", N - 50)));
+}
+
+TEST_CASE("Node limit") {
+    constexpr usz N = 10'000;
+    auto input = Repeat("*a* `b` ", N);
+    Parser p{input, {.max_nodes = 64}};
+    CHECK(p.status.nodes_exceeded);
+    CHECK(CountNodes(p.nodes) <= 64);
+    auto s = p.Print();
+    CHECK(s.ends_with(Repeat("*a* `b` ", N - 15)));
+
+    // Emphasis must respect the limit too.
+    Parser q{"***a*** ***b***", {.max_nodes = 6}};
+    CHECK(q.status.nodes_exceeded);
+    CHECK(CountNodes(q.nodes) <= 6);
+}
+
+TEST_CASE("Output limit") {
+    constexpr usz N = 10'000;
+    auto input = Repeat("*a **b `c` d** e* ", N);
+    for (usz limit : {0, 1, 10, 37, 100, 1'000}) {
+        Parser p{input, {.max_output_bytes = limit}};
+        auto s = p.Print();
+        CHECK(p.status.output_bytes_exceeded);
+        CHECK(s.size() <= limit);
+        CHECK(Count(s, "<em>") == Count(s, "</em>"));
+        CHECK(Count(s, "<strong>") == Count(s, "</strong>"));
+        CHECK(Count(s, "<code>") == Count(s, "</code>"));
+    }
+}
+
+TEST_CASE("Interleaved delimiter kinds") {
+    T("*_~~||*_~~||*_~~||", "<em>_~~||</em><em>~~||*</em>~~||");
+    T("*a _b ~~c ||d e|| f~~ g_ h*", "<em>a <em>b <del>c <spoiler>d e</spoiler> f</del> g</em> h</em>");
+    T("*a _b ~~c ||d e* f_ g~~ h||", "<em>a _b ~~c ||d e</em> f_ g~~ h||");
+    T("_a _a ~~a a* a~~ ~~a a* a~~ ", "_a _a <del>a a* a</del> <del>a a* a</del> ");
+}
+
+TEST_CASE("Interleaved delimiter kinds scale linearly", "[.][benchmark]") {
+    // Every `*` closer here fails to find an opener, and the delimiter that
+    // bounds the search for the next one is removed in between.
+    for (usz n : {1'000, 10'000, 100'000}) {
+        auto input = Repeat("_a ", n) + Repeat("~~a a* a~~ ", n);
+        BENCHMARK("Unmatched closers over " + std::to_string(n) + " openers") {
+            return Parser{input}.Print();
+        };
+    }
+
+    for (usz n : {1'000, 10'000, 100'000}) {
+        auto input = Repeat("*_~~||", n);
+        BENCHMARK("All delimiter kinds, " + std::to_string(n) + " times") {
+            return Parser{input}.Print();
+        };
+    }
+}
+
+auto Runs(std::string_view input) -> std::vector<std::pair<std::string, u8>> {
+    std::vector<Parser::StyleRun> runs;
+    std::string buffer;
+    Parser(input).PrintStyleRuns(runs, buffer);
+    std::vector<std::pair<std::string, u8>> out;
+    for (auto& r : runs) out.emplace_back(std::string{r.text}, r.style);
+    return out;
+}
+
+TEST_CASE("Style runs") {
+    using R = std::vector<std::pair<std::string, u8>>;
+    using S = Parser::StyleRun;
+    CHECK(Runs("") == R{});
+    CHECK(Runs("hi *there*") == R{{"hi ", 0}, {"there", S::Italic}});
+    CHECK(Runs("***a*** b") == R{{"a", S::Bold | S::Italic}, {" b", 0}});
+    CHECK(Runs("__u__ `c`") == R{{"u", S::Underline}, {" ", 0}, {"c", S::Code}});
+    CHECK(Runs("~~x ||y||~~") == R{{"x ", S::Strikethrough}, {"y", S::Strikethrough | S::Spoiler}});
+    CHECK(Runs("**a *b* c**") == R{{"a ", S::Bold}, {"b", S::Bold | S::Italic}, {" c", S::Bold}});
+
+    SECTION("Popping a style restores the previous one") {
+        CHECK(Runs("*_a_ b*") == R{{"a b", S::Italic}});
+        CHECK(Runs("*a **b** c*") == R{{"a ", S::Italic}, {"b", S::Italic | S::Bold}, {" c", S::Italic}});
+    }
+
+    SECTION("Adjacent runs with the same style are merged") {
+        CHECK(Runs("*a*_b_") == R{{"ab", S::Italic}});
+        CHECK(Runs("a\\*b\\_c") == R{{"a*b_c", 0}});
+        CHECK(Runs("`a``b``c`") == R{{"a``b``c", S::Code}});
+    }
+
+    SECTION("Code spans are normalised") {
+        CHECK(Runs("`` `a` ``") == R{{"`a`", S::Code}});
+        CHECK(Runs("``\nfoo\nbar  \nbaz\n``") == R{{"foo bar   baz", S::Code}});
+        CHECK(Runs("`    `") == R{{"    ", S::Code}});
+    }
+
+    SECTION("Unchanged text points into the input") {
+        std::string_view input = "plain **bold** text";
+        std::vector<Parser::StyleRun> runs;
+        std::string buffer;
+        Parser(input).PrintStyleRuns(runs, buffer);
+        REQUIRE(runs.size() == 3);
+        for (auto& r : runs) {
+            CHECK(r.text.data() >= input.data());
+            CHECK(r.text.data() + r.text.size() <= input.data() + input.size());
+        }
+        CHECK(buffer.empty());
+    }
+
+    SECTION("Output vectors are reused") {
+        std::vector<Parser::StyleRun> runs;
+        std::string buffer;
+        Parser("a\\*b *c*").PrintStyleRuns(runs, buffer);
+        CHECK(runs.size() == 2);
+        Parser("x").PrintStyleRuns(runs, buffer);
+        REQUIRE(runs.size() == 1);
+        CHECK(runs[0].text == "x");
+        CHECK(buffer.empty());
+    }
+
+    SECTION("Output limit") {
+        std::vector<Parser::StyleRun> runs;
+        std::string buffer;
+        Parser p{"abc *def* `ghi`", {.max_output_bytes = 6}};
+        p.PrintStyleRuns(runs, buffer);
+        REQUIRE(runs.size() == 1);
+        CHECK(runs[0].text == "abc ");
+        CHECK(p.status.output_bytes_exceeded);
+
+        // Code spans are emitted entirely or not at all.
+        Parser code{"a `b\nc` d", {.max_output_bytes = 5}};
+        code.PrintStyleRuns(runs, buffer);
+        REQUIRE(runs.size() == 2);
+        CHECK(runs[1].text == "b c");
+        CHECK(runs[1].style == S::Code);
+        CHECK(code.status.output_bytes_exceeded);
+
+        Parser unlimited{"abc *def* `ghi`"};
+        unlimited.PrintStyleRuns(runs, buffer);
+        CHECK(runs.size() == 4);
+        CHECK(not unlimited.status.output_bytes_exceeded);
+    }
+}
+
+TEST_CASE("UTF-16 input") {
+    // A surrogate pair is a single character that is neither whitespace nor punctuation.
+    CHECK(P16(u"😀*foo*😀") == u"😀<em>foo</em>😀");
+    CHECK(P16(u"😀_foo_😀") == u"😀_foo_😀");
+    CHECK(P16(u"*😀*") == u"<em>😀</em>");
+    CHECK(P16(u"**😀 foo**😀") == u"<strong>😀 foo</strong>😀");
+    CHECK(P16(u"`😀\n😀`") == u"<code>😀 😀</code>");
+
+    // Lone surrogates are replaced, but otherwise treated like any other character.
+    CHECK(P16(u"\xD800*foo*\xDC00") == u"\uFFFD<em>foo</em>\uFFFD");
+    CHECK(P16(u"\xDC00*foo* \xD800") == u"\uFFFD<em>foo</em> \uFFFD");
+    CHECK(P16(u"\xDC00\xD800 `\xD800`") == u"\uFFFD\uFFFD <code>\uFFFD</code>");
+
+    // Escapes only apply to ASCII punctuation.
+    CHECK(P16(u"\\\u202A\\*") == u"\\\u202A*");
+
+    SECTION("Style runs") {
+        std::u16string_view input = u"😀 **bold** \\*";
+        std::vector<Parser16::StyleRun> runs;
+        std::u16string buffer;
+        Parser16(input).PrintStyleRuns(runs, buffer);
+        REQUIRE(runs.size() == 3);
+        CHECK(runs[0].text == u"😀 ");
+        CHECK(runs[0].text.data() == input.data());
+        CHECK(runs[1].text == u"bold");
+        CHECK(runs[1].style == Parser16::StyleRun::Bold);
+        CHECK(runs[2].text == u" *");
+    }
+
+    SECTION("Output limit counts bytes") {
+        Parser16 p{u"*a* *b*", {.max_output_bytes = 2 * 10}};
+        CHECK(p.Print() == u"<em>a</em>");
+        CHECK(p.status.output_bytes_exceeded);
+    }
+}
+
+TEST_CASE("Invalid UTF-8") {
+    // Every maximal subpart of an invalid sequence becomes one U+FFFD.
+    CHECK(P("a\xFF" "b") == "a\uFFFD" "b");
+    CHECK(P("\x80\x80") == "\uFFFD\uFFFD");
+    CHECK(P("\xC0\xAF") == "\uFFFD\uFFFD");
+    CHECK(P("\xE2\x82") == "\uFFFD");
+    CHECK(P("\xE2\x82*a*") == "\uFFFD<em>a</em>");
+    CHECK(P("\xED\xA0\x80") == "\uFFFD\uFFFD\uFFFD");
+    CHECK(P("\xF0\x9F\x98") == "\uFFFD");
+    CHECK(P("\xF4\x90\x80\x80") == "\uFFFD\uFFFD\uFFFD\uFFFD");
+    CHECK(P("\xF8\x88\x80\x80\x80") == "\uFFFD\uFFFD\uFFFD\uFFFD\uFFFD");
+
+    // Valid input is unchanged.
+    CHECK(P("\u00E9 \u20AC \U0001F600 \U0010FFFF *\uD7FF*") == "\u00E9 \u20AC \U0001F600 \U0010FFFF <em>\uD7FF</em>");
+    CHECK(Parser{"\u00E9 \U0001F600"}.status.ok());
+
+    // Invalid bytes are replaced everywhere and don’t affect delimiters.
+    CHECK(P("*\xFF*") == "<em>\uFFFD</em>");
+    CHECK(P("`\xFF\n\xC3`") == "<code>\uFFFD \uFFFD</code>");
+    CHECK(P("\\\xFF\\*\xFF") == "\\\uFFFD*\uFFFD");
+    CHECK(P("``\xFF`") == "``\uFFFD`");
+
+    // Both the fast path and the tail of the input find invalid bytes at any offset.
+    for (usz i = 0; i < 24; i++) {
+        auto input = std::string(i, 'a') + "\xFF" + std::string(24 - i, '*');
+        auto expected = std::string(i, 'a') + "\uFFFD" + std::string(24 - i, '*');
+        INFO(i);
+        CHECK(P(input) == expected);
+    }
+
+    SECTION("Status") {
+        Parser p{"a\xFF"};
+        CHECK(p.status.invalid_encoding);
+        CHECK(not p.status.limit_exceeded());
+        CHECK(not p.status.ok());
+    }
+
+    SECTION("Reject") {
+        for (std::string_view input : {"*a* \xFF", "`\xFF`", "\xFF **a**", "**a \xFF b**"}) {
+            Parser p{input, {}, Parser::OnInvalidEncoding::Reject};
+            INFO(input);
+            CHECK(p.status.invalid_encoding);
+            CHECK(p.Print() == "");
+        }
+
+        Parser p{"*a* \u00E9", {}, Parser::OnInvalidEncoding::Reject};
+        CHECK(p.Print() == "<em>a</em> \u00E9");
+    }
+
+    SECTION("Style runs") {
+        std::string_view input = "a\xFF *b\xC3*";
+        std::vector<Parser::StyleRun> runs;
+        std::string buffer;
+        Parser(input).PrintStyleRuns(runs, buffer);
+        REQUIRE(runs.size() == 2);
+        CHECK(runs[0].text == "a\uFFFD ");
+        CHECK(runs[0].style == 0);
+        CHECK(runs[1].text == "b\uFFFD");
+        CHECK(runs[1].style == Parser::StyleRun::Italic);
+    }
+}
+
+TEST_CASE("Short messages don’t allocate") {
+    std::string_view inputs[] = {
+        "",
+        "hi *there*",
+        "**bold** *italic* __underline__ ~~strikethrough~~ ||spoiler|| `code` \\*escaped\\*",
+        "*foo **bar *baz* bim** bop* and some more text to fill up a typical chat line, `with code`",
+        "``\nfoo\nbar  \nbaz\n`` *a **b** c* ***d*** _e_ __f__ ~~g~~ ||h|| *i* _j_ *k* _l_ *m* _n_ *o*",
+    };
+
+    for (auto input : inputs) {
+        REQUIRE(input.size() <= 128);
+        auto expected = P(input);
+        auto before = allocations;
+        bool same;
+        {
+            Parser p{input};
+            same = p.PrintInline() == expected;
+        }
+        auto after = allocations;
+        INFO(input);
+        CHECK(after == before);
+        CHECK(same);
+    }
+
+    SECTION("UTF-16") {
+        std::u16string_view input = u"😀 **bold** *italic* `code`";
+        auto before = allocations;
+        bool same;
+        {
+            Parser16 p{input};
+            same = p.PrintInline() == u"😀 <strong>bold</strong> <em>italic</em> <code>code</code>";
+        }
+        auto after = allocations;
+        CHECK(after == before);
+        CHECK(same);
+    }
+
+    SECTION("Long messages fall back to the heap") {
+        auto input = Repeat("*a **b `c` d** e* ", 1'000);
+        auto expected = P(input);
+        Parser p{input};
+        CHECK(p.PrintInline() == expected);
+        CHECK(p.PrintInline() == expected);
+    }
+}